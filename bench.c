@@ -0,0 +1,238 @@
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hashmap.h"
+
+#define KEY_LEN 24
+
+typedef struct counter {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+  int fd;
+} counter_t;
+
+static counter_t counters[] = {
+    {"dTLB-load-misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+     -1},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1},
+};
+
+#define NCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+// Counters are optional: inside containers or with a strict
+// `perf_event_paranoid` they cannot be opened and are reported as n/a.
+void counters_open() {
+  for (size_t i = 0; i < NCOUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[i].type;
+    attr.config = counters[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+void counters_start() {
+  for (size_t i = 0; i < NCOUNTERS; i++) {
+    if (counters[i].fd < 0)
+      continue;
+    ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void counters_stop_and_print() {
+  for (size_t i = 0; i < NCOUNTERS; i++) {
+    uint64_t v;
+    if (counters[i].fd < 0 ||
+        ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0) != 0 ||
+        read(counters[i].fd, &v, sizeof(v)) != sizeof(v)) {
+      printf("  %-18s n/a\n", counters[i].name);
+      continue;
+    }
+    printf("  %-18s %" PRIu64 "\n", counters[i].name, v);
+  }
+}
+
+void counters_close() {
+  for (size_t i = 0; i < NCOUNTERS; i++) {
+    if (counters[i].fd >= 0)
+      close(counters[i].fd);
+    counters[i].fd = -1;
+  }
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t xorshift(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+char *make_keys(size_t n) {
+  char *keys = malloc(n * KEY_LEN);
+  for (size_t i = 0; i < n; i++)
+    snprintf(keys + i * KEY_LEN, KEY_LEN, "k%zu", i);
+  return keys;
+}
+
+void bench_random_get(const char *name, uint8_t opts, const char *keys,
+                      size_t nkeys, size_t nlookups) {
+  map_t m = hashmap_new_opts(size_t, 0, opts);
+  double start = now();
+  for (size_t i = 0; i < nkeys; i++)
+    hashmap_insert(m, keys + i * KEY_LEN, &i);
+  double insert_secs = now() - start;
+
+  uint64_t state = 88172645463325252ULL;
+  size_t found = 0;
+  counters_start();
+  start = now();
+  for (size_t i = 0; i < nlookups; i++) {
+    size_t v;
+    size_t k = xorshift(&state) % nkeys;
+    if (hashmap_get(m, keys + k * KEY_LEN, &v) == MAP_OK && v == k)
+      found++;
+  }
+  double get_secs = now() - start;
+
+  printf("%s:\n", name);
+  printf("  insert             %.1f ns/op\n", insert_secs * 1e9 / nkeys);
+  printf("  random get         %.1f ns/op\n", get_secs * 1e9 / nlookups);
+  counters_stop_and_print();
+  if (found != nlookups)
+    fprintf(stderr, "lookup mismatch: %zu/%zu\n", found, nlookups);
+  hashmap_free(m);
+}
+
+void add_size(void *value, const void *delta) {
+  *(size_t *)value += *(const size_t *)delta;
+}
+
+void sum_fold(void *acc, const char *key, const void *value, void *ctx) {
+  (void)key;
+  (void)ctx;
+  *(size_t *)acc += *(const size_t *)value;
+}
+
+void sum_merge(void *acc, const void *other, void *ctx) {
+  (void)ctx;
+  *(size_t *)acc += *(const size_t *)other;
+}
+
+void report_records(const char *name, map_t m, size_t nrecords, double secs) {
+  size_t total = 0;
+  hashmap_parallel_reduce(m, 1, sum_fold, sum_merge, &total, sizeof(total),
+                          NULL);
+  printf("  %-26s %6.2f M records/s\n", name, nrecords / secs / 1e6);
+  if (total != nrecords)
+    fprintf(stderr, "count mismatch: %zu/%zu\n", total, nrecords);
+}
+
+// Count occurrences of skewed words, as in a group-by/count workload.
+void bench_word_count(size_t nrecords, size_t max_threads) {
+  const size_t nwords = 100000;
+  char *words = make_keys(nwords);
+  const char **records = malloc(nrecords * sizeof(char *));
+  size_t *ones = malloc(nrecords * sizeof(size_t));
+  uint64_t state = 88172645463325252ULL;
+  for (size_t i = 0; i < nrecords; i++) {
+    // Product of two uniform indexes favors small ones.
+    size_t w = (xorshift(&state) % nwords) * (xorshift(&state) % nwords);
+    records[i] = words + w / nwords * KEY_LEN;
+    ones[i] = 1;
+  }
+
+  // Thread counts above the online CPUs only measure contention.
+  printf("word count: %zu records, %zu words, %ld online cpu(s)\n", nrecords,
+         nwords, sysconf(_SC_NPROCESSORS_ONLN));
+
+  map_t m = hashmap_new(size_t, 0);
+  double start = now();
+  for (size_t i = 0; i < nrecords; i++) {
+    size_t v = 0;
+    hashmap_get(m, records[i], &v);
+    v++;
+    hashmap_insert(m, records[i], &v);
+  }
+  report_records("get + insert", m, nrecords, now() - start);
+  hashmap_free(m);
+
+  m = hashmap_new(size_t, 0);
+  start = now();
+  for (size_t i = 0; i < nrecords; i++)
+    hashmap_accumulate(m, records[i], &ones[i], add_size);
+  report_records("accumulate", m, nrecords, now() - start);
+  hashmap_free(m);
+
+  for (size_t nthreads = 1; nthreads <= max_threads; nthreads++) {
+    char name[32];
+    snprintf(name, sizeof(name), "parallel, %zu thread(s)", nthreads);
+    m = hashmap_new(size_t, 0);
+    start = now();
+    hashmap_parallel_accumulate(m, nthreads, records, ones, nrecords,
+                                add_size);
+    report_records(name, m, nrecords, now() - start);
+    hashmap_free(m);
+  }
+
+  free(ones);
+  free(records);
+  free(words);
+}
+
+void bench_lookup(size_t nkeys) {
+  size_t nlookups = (size_t)4 << 20;
+  char *keys = make_keys(nkeys);
+
+  counters_open();
+  printf("keys: %zu, lookups: %zu\n\n", nkeys, nlookups);
+  bench_random_get("default", 0, keys, nkeys, nlookups);
+  bench_random_get("huge pages + cache aligned",
+                   MAP_OPT_HUGE_PAGES | MAP_OPT_CACHE_ALIGN, keys, nkeys,
+                   nlookups);
+  counters_close();
+
+  free(keys);
+}
+
+// Usage: bench [lookup [nkeys] | wordcount [nrecords [max_threads]]]
+int main(int argc, char **argv) {
+  const char *mode = argc > 1 ? argv[1] : "all";
+  if (strcmp(mode, "lookup") == 0 || strcmp(mode, "all") == 0) {
+    // Default to a map with B >= 20, where TLB misses dominate lookups.
+    size_t nkeys = argc > 2 ? strtoull(argv[2], NULL, 10) : (size_t)4 << 20;
+    bench_lookup(nkeys);
+  }
+  if (strcmp(mode, "all") == 0)
+    printf("\n");
+  if (strcmp(mode, "wordcount") == 0 || strcmp(mode, "all") == 0) {
+    size_t nrecords =
+        argc > 2 ? strtoull(argv[2], NULL, 10) : (size_t)4 << 20;
+    size_t max_threads = argc > 3 ? strtoull(argv[3], NULL, 10)
+                                  : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+    bench_word_count(nrecords, max_threads);
+  }
+}
@@ -1,11 +1,14 @@
 #include "hashmap.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #define DEBUG // debug enabled
 
@@ -32,6 +35,17 @@
 #define TOPHASH_MIN 5
 
 #define FLAG_SAME_SIZE_GROW 8
+// `buckets` was allocated with mmap and must be released with munmap.
+#define FLAG_BUCKETS_MAPPED 16
+// Same as above, for `oldbuckets`.
+#define FLAG_OLDBUCKETS_MAPPED 32
+
+// Size of a key arena chunk. Keys longer than a quarter of it get a chunk of
+// their own so that the current chunk keeps being filled.
+#define KEY_CHUNK_SIZE 65536
+
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
 
 #define panicf(...)                                                            \
   do {                                                                         \
@@ -66,11 +80,26 @@ typedef struct bmap {
   uint8_t values[];
 } bmap_t;
 
+// `tophash` and `overflow` are read on every probe, so with
+// `MAP_OPT_CACHE_ALIGN` they must share the first cache line of a bucket,
+// followed by as many key pointers as fit.
+_Static_assert(offsetof(bmap_t, keys) <= CACHE_LINE_SIZE,
+               "bucket metadata must fit in the first cache line");
+
+// Chunk of the arena owning keys of a map created with `MAP_OPT_OWNED_KEYS`.
+typedef struct key_chunk {
+  struct key_chunk *next;
+  size_t used;
+  size_t cap;
+  char data[];
+} key_chunk_t;
+
 typedef struct hmap {
   size_t count;
   uint8_t flags;
   uint8_t B; // log2(len(buckets))
   uint8_t value_size;
+  uint8_t opts; // MAP_OPT_*
   uint16_t bucket_size;
   uint16_t noverflow;
 
@@ -80,6 +109,9 @@ typedef struct hmap {
   size_t nevacuate;
 
   void *next_overflow;
+
+  // Arena of owned keys, the chunk being filled comes first.
+  key_chunk_t *key_chunks;
 } hmap_t;
 
 static unsigned long crc32_tab[] = {
@@ -171,6 +203,16 @@ size_t bucket_shift(uint8_t b) {
 
 size_t bucket_mask(uint8_t b) { return bucket_shift(b) - 1; }
 
+// Number of normal buckets plus preallocated overflow buckets of an array
+// made by `make_bucket_array`.
+size_t total_buckets(uint8_t b) {
+  return b >= 4 ? bucket_shift(b) + bucket_shift(b - 4) : bucket_shift(b);
+}
+
+size_t round_up(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
 bool bucket_evacuated(bmap_t *b) {
   uint8_t h = b->tophash[0];
   return h > TOPHASH_EMPTY_ONE && h < TOPHASH_MIN;
@@ -187,6 +229,8 @@ size_t noldbuckets(hmap_t *h) {
 
 size_t oldbucket_mask(hmap_t *h) { return noldbuckets(h) - 1; }
 
+uint8_t old_B(hmap_t *h) { return same_size_grow(h) ? h->B : h->B - 1; }
+
 uint8_t tophash(size_t hash) {
   uint8_t top = hash >> (sizeof(hash) * 8 - 8);
   return top < TOPHASH_MIN ? top + TOPHASH_MIN : top;
@@ -207,17 +251,83 @@ bool too_many_overflow_buckets(uint16_t noverflow, uint8_t B) {
   return noverflow >= (uint16_t)1 << (B > 15 ? 15 : B);
 }
 
+// Map `len` bytes of zeroed memory aligned to `HUGE_PAGE_SIZE` so that the
+// whole range can be backed by huge pages. Returns NULL on failure.
+void *map_huge_pages(size_t len) {
+  void *p;
+#ifdef MAP_HUGETLB
+  // Explicit huge pages only succeed when a hugetlbfs pool is reserved.
+  p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED)
+    return p;
+#endif
+
+  // Over-map by one huge page and trim both ends, otherwise transparent huge
+  // pages can only back the aligned middle part.
+  p = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  uint8_t *start = p;
+  uint8_t *aligned = (uint8_t *)round_up((uintptr_t)start, HUGE_PAGE_SIZE);
+  if (aligned != start)
+    munmap(start, aligned - start);
+  munmap(aligned + len, start + HUGE_PAGE_SIZE - aligned);
+
+#ifdef MADV_HUGEPAGE
+  // Only a hint, regular pages are still fine if THP is disabled.
+  madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+  return aligned;
+}
+
+void *alloc_bucket_array(hmap_t *h, size_t size, bool *mapped) {
+  *mapped = false;
+  if ((h->opts & MAP_OPT_HUGE_PAGES) && size >= HUGE_PAGE_SIZE) {
+    void *p = map_huge_pages(round_up(size, HUGE_PAGE_SIZE));
+    if (p) {
+      *mapped = true;
+      return p;
+    }
+  }
+
+  if (h->opts & MAP_OPT_CACHE_ALIGN) {
+    void *p = aligned_alloc(CACHE_LINE_SIZE, size);
+    if (p)
+      memset(p, 0, size); // NOLINT
+    return p;
+  }
+  return calloc(1, size);
+}
+
+void free_bucket_array(hmap_t *h, void *buckets, uint8_t b, bool mapped) {
+  if (mapped)
+    munmap(buckets,
+           round_up(total_buckets(b) * h->bucket_size, HUGE_PAGE_SIZE));
+  else
+    free(buckets);
+}
+
+// Allocate a single zeroed bucket outside of any bucket array.
+bmap_t *alloc_bucket(hmap_t *h) {
+  bool mapped;
+  return alloc_bucket_array(h, h->bucket_size, &mapped);
+}
+
 void make_bucket_array(hmap_t *h) {
   size_t nnormals = bucket_shift(h->B);
-  size_t nbuckets = nnormals;
-
   // For small b, overflow is almost impossible so do not allocate extra
-  // memory for overflow buckets.
-  if (h->B >= 4)
-    // About extra 1/16 of normal buckets is allocated for overflow buckets.
-    nbuckets += bucket_shift(h->B - 4);
-
-  h->buckets = calloc(nbuckets, h->bucket_size);
+  // memory for overflow buckets. Otherwise about extra 1/16 of normal buckets
+  // is allocated for overflow buckets.
+  size_t nbuckets = total_buckets(h->B);
+
+  bool mapped;
+  h->buckets = alloc_bucket_array(h, nbuckets * h->bucket_size, &mapped);
+  if (mapped)
+    h->flags |= FLAG_BUCKETS_MAPPED;
+  else
+    h->flags &= ~FLAG_BUCKETS_MAPPED;
 
   if (nnormals != nbuckets) {
     // If there are overflow buckets allocated, set first overflow bucket as
@@ -235,9 +345,12 @@ void make_bucket_array(hmap_t *h) {
   }
 }
 
-map_t _hashmap_new(uint8_t value_size, size_t hint) {
-  assert(value_size <= 16);
-  const size_t bucket_size = sizeof(bmap_t) + value_size * BUCKET_COUNT;
+// Same as `_hashmap_new` without the public limit on value size, for internal
+// maps storing extra data along with values.
+hmap_t *makemap(uint8_t value_size, size_t hint, uint8_t opts) {
+  size_t bucket_size = sizeof(bmap_t) + value_size * BUCKET_COUNT;
+  if (opts & MAP_OPT_CACHE_ALIGN)
+    bucket_size = round_up(bucket_size, CACHE_LINE_SIZE);
   if (bucket_size > (uint16_t)(-1)) {
     panicf("Bucket size(%zu) exceeds limit(%d), use pointer as value "
            "instead\n",
@@ -248,12 +361,14 @@ map_t _hashmap_new(uint8_t value_size, size_t hint) {
   h->count = 0;
   h->flags = 0;
   h->value_size = value_size;
+  h->opts = opts;
   h->bucket_size = bucket_size;
   h->noverflow = 0;
   h->buckets = NULL;
   h->oldbuckets = NULL;
   h->nevacuate = 0;
   h->next_overflow = NULL;
+  h->key_chunks = NULL;
 
   uint8_t B = 0;
   while (over_load_factor(hint, B))
@@ -266,6 +381,11 @@ map_t _hashmap_new(uint8_t value_size, size_t hint) {
   return h;
 }
 
+map_t _hashmap_new(uint8_t value_size, size_t hint, uint8_t opts) {
+  assert(value_size <= 16);
+  return makemap(value_size, hint, opts);
+}
+
 void hash_grow(hmap_t *h) {
   if (over_load_factor(h->count + 1, h->B))
     h->B++;
@@ -273,6 +393,10 @@ void hash_grow(hmap_t *h) {
     h->flags |= FLAG_SAME_SIZE_GROW;
 
   h->oldbuckets = h->buckets;
+  if (h->flags & FLAG_BUCKETS_MAPPED)
+    h->flags |= FLAG_OLDBUCKETS_MAPPED;
+  else
+    h->flags &= ~FLAG_OLDBUCKETS_MAPPED;
   make_bucket_array(h);
   h->nevacuate = 0;
   h->noverflow = 0;
@@ -288,9 +412,10 @@ void advance_evacuation_mark(hmap_t *h, size_t nold) {
                                      h->bucket_size * h->nevacuate)))
     h->nevacuate++;
   if (h->nevacuate == nold) {
-    free(h->oldbuckets);
+    free_bucket_array(h, h->oldbuckets, old_B(h),
+                      h->flags & FLAG_OLDBUCKETS_MAPPED);
     h->oldbuckets = NULL;
-    h->flags &= ~FLAG_SAME_SIZE_GROW;
+    h->flags &= ~(FLAG_SAME_SIZE_GROW | FLAG_OLDBUCKETS_MAPPED);
   }
 }
 
@@ -306,7 +431,7 @@ bmap_t *new_overflow(hmap_t *h, bmap_t *b) {
       h->next_overflow = NULL;
     }
   } else {
-    ovf = calloc(h->bucket_size, 1);
+    ovf = alloc_bucket(h);
   }
 
   if (h->B < 16) {
@@ -325,7 +450,7 @@ bmap_t *new_overflow(hmap_t *h, bmap_t *b) {
 bool is_isolated_overflow(const void *b, const void *buckets,
                           size_t bucket_size, size_t nbuckets) {
   return b < buckets ||
-         b > (void *)((uint8_t *)buckets + nbuckets * bucket_size);
+         b >= (void *)((uint8_t *)buckets + nbuckets * bucket_size);
 }
 
 void evacuate(hmap_t *h, size_t oldbucket_index) {
@@ -395,9 +520,8 @@ void evacuate(hmap_t *h, size_t oldbucket_index) {
       b = b->overflow;
 
       // If b is isolated overflow bucket, we need to free it.
-      if (h->B < 4 ||
-          is_isolated_overflow(oldb, h->oldbuckets, h->bucket_size,
-                               bucket_shift(h->B) + bucket_shift(h->B - 4)))
+      if (is_isolated_overflow(oldb, h->oldbuckets, h->bucket_size,
+                               total_buckets(old_B(h))))
         free(oldb);
     }
   }
@@ -412,6 +536,80 @@ void grow_work(hmap_t *h, size_t bucket_index) {
     evacuate(h, h->nevacuate);
 }
 
+key_chunk_t *new_key_chunk(size_t cap) {
+  key_chunk_t *c = malloc(sizeof(key_chunk_t) + cap);
+  c->next = NULL;
+  c->used = 0;
+  c->cap = cap;
+  return c;
+}
+
+// Copy `key` into the arena of `h`, packed right after the previous key.
+const char *arena_strdup(hmap_t *h, const char *key) {
+  size_t len = strlen(key) + 1;
+  key_chunk_t *c = h->key_chunks;
+  if (len > KEY_CHUNK_SIZE / 4) {
+    key_chunk_t *big = new_key_chunk(len);
+    if (c) {
+      big->next = c->next;
+      c->next = big;
+    } else {
+      h->key_chunks = big;
+    }
+    c = big;
+  } else if (!c || c->cap - c->used < len) {
+    c = new_key_chunk(KEY_CHUNK_SIZE);
+    c->next = h->key_chunks;
+    h->key_chunks = c;
+  }
+
+  char *dst = c->data + c->used;
+  memcpy(dst, key, len); // NOLINT
+  c->used += len;
+  return dst;
+}
+
+// Free isolated overflow buckets reachable from the normal buckets of
+// `buckets`, which has `bucket_shift(b)` normal buckets.
+void free_overflow_chains(hmap_t *h, void *buckets, uint8_t b) {
+  size_t nbuckets = total_buckets(b);
+  uint8_t *nb = buckets;
+  for (size_t n = 0; n < bucket_shift(b); n++, nb += h->bucket_size) {
+    // Overflow chain of an evacuated bucket has been freed by `evacuate`.
+    if (bucket_evacuated((bmap_t *)nb))
+      continue;
+    for (bmap_t *ovf = ((bmap_t *)nb)->overflow; ovf;) {
+      bmap_t *next = ovf->overflow;
+      if (is_isolated_overflow(ovf, buckets, h->bucket_size, nbuckets))
+        free(ovf);
+      ovf = next;
+    }
+  }
+}
+
+void hashmap_free(map_t m) {
+  hmap_t *h = m;
+  if (!h)
+    return;
+
+  if (h->oldbuckets) {
+    uint8_t oldB = old_B(h);
+    free_overflow_chains(h, h->oldbuckets, oldB);
+    free_bucket_array(h, h->oldbuckets, oldB,
+                      h->flags & FLAG_OLDBUCKETS_MAPPED);
+  }
+  if (h->buckets) {
+    free_overflow_chains(h, h->buckets, h->B);
+    free_bucket_array(h, h->buckets, h->B, h->flags & FLAG_BUCKETS_MAPPED);
+  }
+  for (key_chunk_t *c = h->key_chunks; c;) {
+    key_chunk_t *next = c->next;
+    free(c);
+    c = next;
+  }
+  free(h);
+}
+
 void hashmap_print(map_t m) {
   if (!m) {
     printf("Uninitialized map\n");
@@ -546,17 +744,13 @@ int hashmap_get(map_t m, const char *key, void *value_ref) {
   return MAP_NOT_FOUND;
 }
 
-int hashmap_insert(map_t m, const char *key, const void *value_ref) {
-  if (!m)
-    panicf("Map uninitialized\n");
-  hmap_t *h = m;
-  if (!value_ref && h->value_size != 0)
-    panicf("Value pointer must not be NULL if value size is not zero\n");
-
+// Find the entry of `key` or create it if absent, and return where its value
+// is stored. Values of new entries are zeroed. `stored_key` receives the key
+// pointer kept by the map and `inserted` whether the entry is new.
+void *mapassign(hmap_t *h, const char *key, size_t hash,
+                const char **stored_key, bool *inserted) {
   if (!h->buckets)
-    h->buckets = calloc(1, h->bucket_size);
-
-  size_t hash = hash_str(key);
+    make_bucket_array(h);
 
 again:;
   size_t bucket_index = hash & bucket_mask(h->B);
@@ -583,10 +777,10 @@ again:;
         continue;
       }
       if (strcmp(b->keys[i], key) == 0) {
-        // Already have a mapping for key. Update it.
-        if (h->value_size > 0)
-          value_write = b->values + h->value_size * i;
-        goto writevalue;
+        // Already have a mapping for key.
+        *stored_key = b->keys[i];
+        *inserted = false;
+        return b->values + h->value_size * i;
       }
     }
     bmap_t *ovf = b->overflow;
@@ -610,12 +804,459 @@ writekey:
   }
 
   *top_write = top;
-  *key_write = key;
+  *key_write = h->opts & MAP_OPT_OWNED_KEYS ? arena_strdup(h, key) : key;
   h->count++;
+  if (h->value_size > 0)
+    memset(value_write, 0, h->value_size); // NOLINT
+
+  *stored_key = *key_write;
+  *inserted = true;
+  return value_write;
+}
 
-writevalue:
+int hashmap_insert(map_t m, const char *key, const void *value_ref) {
+  if (!m)
+    panicf("Map uninitialized\n");
+  hmap_t *h = m;
+  if (!value_ref && h->value_size != 0)
+    panicf("Value pointer must not be NULL if value size is not zero\n");
+
+  const char *stored_key;
+  bool inserted;
+  void *value = mapassign(h, key, hash_str(key), &stored_key, &inserted);
   if (h->value_size > 0)
-    memcpy(value_write, value_ref, h->value_size); // NOLINT
+    memcpy(value, value_ref, h->value_size); // NOLINT
+
+  return MAP_OK;
+}
+
+const char *hashmap_intern(map_t m, const char *key) {
+  if (!m)
+    panicf("Map uninitialized\n");
+
+  const char *stored_key;
+  bool inserted;
+  mapassign(m, key, hash_str(key), &stored_key, &inserted);
+  return stored_key;
+}
+
+size_t hashmap_len(map_t m) {
+  hmap_t *h = m;
+  return h ? h->count : 0;
+}
 
+typedef void (*visit_fn)(void *arg, const char *key, void *value);
+
+// Visit all entries belonging to normal bucket `bucket_index`. While growing,
+// entries not evacuated yet are read from the old bucket instead, skipping
+// those that will be evacuated to the other half of the new array.
+void visit_bucket(hmap_t *h, size_t bucket_index, visit_fn visit, void *arg) {
+  bmap_t *b =
+      (bmap_t *)((uint8_t *)h->buckets + bucket_index * h->bucket_size);
+  bool check_bucket = false;
+  if (h->oldbuckets) {
+    bmap_t *oldb =
+        (bmap_t *)((uint8_t *)h->oldbuckets +
+                   (bucket_index & oldbucket_mask(h)) * h->bucket_size);
+    if (!bucket_evacuated(oldb)) {
+      b = oldb;
+      check_bucket = !same_size_grow(h);
+    }
+  }
+
+  for (; b; b = b->overflow) {
+    uint8_t *v = b->values;
+    for (size_t i = 0; i < BUCKET_COUNT; i++, v += h->value_size) {
+      if (b->tophash[i] < TOPHASH_MIN)
+        continue;
+      if (check_bucket &&
+          (hash_str(b->keys[i]) & bucket_mask(h->B)) != bucket_index)
+        continue;
+      visit(arg, b->keys[i], v);
+    }
+  }
+}
+
+// Normal buckets initially assigned to a worker. Other workers steal from it
+// by claiming from the same cursor once their own range is exhausted.
+typedef struct bucket_range {
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t next;
+  size_t end;
+} bucket_range_t;
+
+typedef struct parallel_task {
+  hmap_t *h;
+  size_t nworkers;
+  size_t grain; // Buckets claimed at a time.
+  bucket_range_t *ranges;
+  visit_fn visit;
+} parallel_task_t;
+
+typedef struct parallel_worker {
+  parallel_task_t *task;
+  size_t id;
+  void *arg; // Passed to `task->visit`.
+  pthread_t thread;
+  bool started;
+} parallel_worker_t;
+
+void *parallel_worker_run(void *arg) {
+  parallel_worker_t *w = arg;
+  parallel_task_t *t = w->task;
+  for (size_t k = 0; k < t->nworkers; k++) {
+    bucket_range_t *r = &t->ranges[(w->id + k) % t->nworkers];
+    for (;;) {
+      size_t start = atomic_fetch_add(&r->next, t->grain);
+      if (start >= r->end)
+        break;
+      size_t end = start + t->grain < r->end ? start + t->grain : r->end;
+      for (size_t i = start; i < end; i++)
+        visit_bucket(t->h, i, t->visit, w->arg);
+    }
+  }
+  return NULL;
+}
+
+// Split normal buckets of `h` evenly among `nworkers` workers and visit them.
+// Worker 0 runs on the calling thread. If a thread fails to start, its range
+// is stolen by the others.
+int parallel_visit(hmap_t *h, parallel_worker_t *workers, size_t nworkers,
+                   visit_fn visit) {
+  size_t nbuckets = bucket_shift(h->B);
+  bucket_range_t *ranges =
+      aligned_alloc(CACHE_LINE_SIZE, nworkers * sizeof(bucket_range_t));
+  if (!ranges)
+    return MAP_OOM;
+
+  parallel_task_t task = {
+      .h = h,
+      .nworkers = nworkers,
+      // Small enough for stealing to balance long overflow chains.
+      .grain = nbuckets / nworkers / 64 + 1,
+      .ranges = ranges,
+      .visit = visit,
+  };
+  for (size_t i = 0; i < nworkers; i++) {
+    atomic_init(&ranges[i].next, nbuckets * i / nworkers);
+    ranges[i].end = nbuckets * (i + 1) / nworkers;
+    workers[i].task = &task;
+    workers[i].id = i;
+    workers[i].started = false;
+  }
+
+  for (size_t i = 1; i < nworkers; i++)
+    workers[i].started = pthread_create(&workers[i].thread, NULL,
+                                        parallel_worker_run, &workers[i]) == 0;
+  parallel_worker_run(&workers[0]);
+  for (size_t i = 1; i < nworkers; i++)
+    if (workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+
+  free(ranges);
+  return MAP_OK;
+}
+
+size_t clamp_nworkers(hmap_t *h, size_t nthreads) {
+  if (nthreads == 0)
+    nthreads = 1;
+  return nthreads < bucket_shift(h->B) ? nthreads : bucket_shift(h->B);
+}
+
+typedef struct for_each_arg {
+  hashmap_iter_fn fn;
+  void *ctx;
+} for_each_arg_t;
+
+void for_each_visit(void *arg, const char *key, void *value) {
+  for_each_arg_t *a = arg;
+  a->fn(key, value, a->ctx);
+}
+
+int hashmap_parallel_for_each(map_t m, size_t nthreads, hashmap_iter_fn fn,
+                              void *ctx) {
+  hmap_t *h = m;
+  if (!h || h->count == 0)
+    return MAP_OK;
+
+  size_t nworkers = clamp_nworkers(h, nthreads);
+  parallel_worker_t *workers = calloc(nworkers, sizeof(parallel_worker_t));
+  if (!workers)
+    return MAP_OOM;
+
+  for_each_arg_t arg = {.fn = fn, .ctx = ctx};
+  for (size_t i = 0; i < nworkers; i++)
+    workers[i].arg = &arg;
+  int ret = parallel_visit(h, workers, nworkers, for_each_visit);
+
+  free(workers);
+  return ret;
+}
+
+typedef struct reduce_arg {
+  hashmap_fold_fn fold;
+  void *ctx;
+  void *acc; // Partial result of one worker.
+} reduce_arg_t;
+
+void reduce_visit(void *arg, const char *key, void *value) {
+  reduce_arg_t *a = arg;
+  a->fold(a->acc, key, value, a->ctx);
+}
+
+int hashmap_parallel_reduce(map_t m, size_t nthreads, hashmap_fold_fn fold,
+                            hashmap_merge_fn merge, void *acc,
+                            size_t acc_size, void *ctx) {
+  hmap_t *h = m;
+  if (!h || h->count == 0)
+    return MAP_OK;
+
+  size_t nworkers = clamp_nworkers(h, nthreads);
+  parallel_worker_t *workers = calloc(nworkers, sizeof(parallel_worker_t));
+  reduce_arg_t *args = calloc(nworkers, sizeof(reduce_arg_t));
+  // Partial results are padded to cache lines to avoid false sharing.
+  size_t stride = round_up(acc_size ? acc_size : 1, CACHE_LINE_SIZE);
+  uint8_t *accs = aligned_alloc(CACHE_LINE_SIZE, nworkers * stride);
+  int ret = MAP_OOM;
+  if (!workers || !args || !accs)
+    goto out;
+
+  for (size_t i = 0; i < nworkers; i++) {
+    args[i].fold = fold;
+    args[i].ctx = ctx;
+    args[i].acc = accs + i * stride;
+    memcpy(args[i].acc, acc, acc_size); // NOLINT
+    workers[i].arg = &args[i];
+  }
+  ret = parallel_visit(h, workers, nworkers, reduce_visit);
+  if (ret == MAP_OK)
+    for (size_t i = 0; i < nworkers; i++)
+      merge(acc, args[i].acc, ctx);
+
+out:
+  free(accs);
+  free(args);
+  free(workers);
+  return ret;
+}
+
+// Upsert `key` with a single probe: store `delta` if absent, otherwise combine
+// it into the existing value.
+void accumulate(hmap_t *h, const char *key, size_t hash, const void *delta,
+                hashmap_combine_fn combine) {
+  const char *stored_key;
+  bool inserted;
+  void *value = mapassign(h, key, hash, &stored_key, &inserted);
+  if (h->value_size == 0)
+    return;
+  if (inserted)
+    memcpy(value, delta, h->value_size); // NOLINT
+  else
+    combine(value, delta);
+}
+
+int hashmap_accumulate(map_t m, const char *key, const void *delta,
+                       hashmap_combine_fn combine) {
+  if (!m)
+    panicf("Map uninitialized\n");
+  hmap_t *h = m;
+  if (!delta && h->value_size != 0)
+    panicf("Delta pointer must not be NULL if value size is not zero\n");
+
+  accumulate(h, key, hash_str(key), delta, combine);
+  return MAP_OK;
+}
+
+// Records are split into partitions by the hash bits right below those used by
+// `tophash`, so the low bits choosing buckets stay uniform inside a partition.
+#define AGG_MAX_PARTITION_BITS 8
+// Cache budget of the partial map of one partition of one worker.
+#define AGG_PARTITION_BYTES ((size_t)256 << 10)
+
+size_t agg_partition(size_t hash, uint8_t bits) {
+  return (hash >> (sizeof(hash) * 8 - 8 - bits)) & (((size_t)1 << bits) - 1);
+}
+
+// Choose the number of partitions so that the partial map of a partition fits
+// in `AGG_PARTITION_BYTES`. Distinct keys are unknown up front, so every record
+// of a worker is assumed distinct, which only costs extra small maps when keys
+// repeat.
+uint8_t agg_partition_bits(size_t nrecords, size_t bucket_size) {
+  size_t bytes = nrecords / LOAD_FACTOR_NUM * LOAD_FACTOR_DEN * bucket_size;
+  uint8_t bits = 0;
+  while (bits < AGG_MAX_PARTITION_BITS && bytes >> bits > AGG_PARTITION_BYTES)
+    bits++;
+  return bits;
+}
+
+// Values of partial maps are prefixed with the hash of their key, so merging
+// them never hashes keys again.
+#define AGG_HASH_SIZE sizeof(size_t)
+
+typedef struct agg_task {
+  hmap_t *h;
+  const char *const *keys;
+  const uint8_t *deltas;
+  size_t n;
+  hashmap_combine_fn combine;
+  size_t nworkers;
+  uint8_t partition_bits;
+  size_t npartitions;
+  // Partial maps, `npartitions` per worker.
+  hmap_t **partials;
+  atomic_size_t next_partition;
+} agg_task_t;
+
+typedef struct agg_worker {
+  agg_task_t *task;
+  size_t id;
+  pthread_t thread;
+} agg_worker_t;
+
+// Same as `accumulate` for a partial map of `h`.
+void accumulate_partial(hmap_t *h, hmap_t *partial, const char *key,
+                        size_t hash, const void *delta,
+                        hashmap_combine_fn combine) {
+  const char *stored_key;
+  bool inserted;
+  uint8_t *value = mapassign(partial, key, hash, &stored_key, &inserted);
+  if (inserted) {
+    memcpy(value, &hash, AGG_HASH_SIZE); // NOLINT
+    if (h->value_size > 0)
+      memcpy(value + AGG_HASH_SIZE, delta, h->value_size); // NOLINT
+  } else if (h->value_size > 0) {
+    combine(value + AGG_HASH_SIZE, delta);
+  }
+}
+
+typedef struct merge_arg {
+  hmap_t *h;
+  hmap_t *dst; // Partial map of `h`, or `h` itself.
+  hashmap_combine_fn combine;
+} merge_arg_t;
+
+void merge_visit(void *arg, const char *key, void *value) {
+  merge_arg_t *a = arg;
+  size_t hash;
+  memcpy(&hash, value, AGG_HASH_SIZE); // NOLINT
+  uint8_t *delta = (uint8_t *)value + AGG_HASH_SIZE;
+  if (a->dst == a->h)
+    accumulate(a->h, key, hash, delta, a->combine);
+  else
+    accumulate_partial(a->h, a->dst, key, hash, delta, a->combine);
+}
+
+// Accumulate all entries of the partial map `src` into `dst` and free `src`.
+void merge_partial(hmap_t *h, hmap_t *dst, hmap_t *src,
+                   hashmap_combine_fn combine) {
+  merge_arg_t arg = {.h = h, .dst = dst, .combine = combine};
+  if (src->buckets)
+    for (size_t i = 0; i < bucket_shift(src->B); i++)
+      visit_bucket(src, i, merge_visit, &arg);
+  hashmap_free(src);
+}
+
+// Pre-aggregate a contiguous slice of the records into the private partial
+// maps of this worker.
+void *agg_worker_partition(void *arg) {
+  agg_worker_t *w = arg;
+  agg_task_t *t = w->task;
+  hmap_t **partials = t->partials + w->id * t->npartitions;
+  size_t end = t->n * (w->id + 1) / t->nworkers;
+  for (size_t i = t->n * w->id / t->nworkers; i < end; i++) {
+    size_t hash = hash_str(t->keys[i]);
+    const void *delta = t->deltas ? t->deltas + i * t->h->value_size : NULL;
+    accumulate_partial(t->h, partials[agg_partition(hash, t->partition_bits)],
+                       t->keys[i], hash, delta, t->combine);
+  }
+  return NULL;
+}
+
+// Merge partial maps of every worker into those of worker 0, one partition at
+// a time. Partitions are claimed dynamically to balance skewed keys.
+void *agg_worker_merge(void *arg) {
+  agg_worker_t *w = arg;
+  agg_task_t *t = w->task;
+  for (;;) {
+    size_t p = atomic_fetch_add(&t->next_partition, 1);
+    if (p >= t->npartitions)
+      break;
+    for (size_t i = 1; i < t->nworkers; i++)
+      merge_partial(t->h, t->partials[p],
+                    t->partials[i * t->npartitions + p], t->combine);
+  }
+  return NULL;
+}
+
+// Run `run` for every worker, worker 0 on the calling thread. Workers whose
+// thread fails to start are run on the calling thread afterwards.
+void agg_run(agg_worker_t *workers, size_t nworkers, void *(*run)(void *)) {
+  bool *started = calloc(nworkers, sizeof(bool));
+  for (size_t i = 1; i < nworkers; i++)
+    started[i] =
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]) == 0;
+  run(&workers[0]);
+  for (size_t i = 1; i < nworkers; i++) {
+    if (started[i])
+      pthread_join(workers[i].thread, NULL);
+    else
+      run(&workers[i]);
+  }
+  free(started);
+}
+
+int hashmap_parallel_accumulate(map_t m, size_t nthreads,
+                                const char *const *keys, const void *deltas,
+                                size_t n, hashmap_combine_fn combine) {
+  if (!m)
+    panicf("Map uninitialized\n");
+  hmap_t *h = m;
+  if (!deltas && h->value_size != 0)
+    panicf("Delta pointer must not be NULL if value size is not zero\n");
+  if (n == 0)
+    return MAP_OK;
+
+  size_t nworkers = nthreads == 0 ? 1 : nthreads < n ? nthreads : n;
+  uint8_t partial_value_size = AGG_HASH_SIZE + h->value_size;
+  uint8_t partition_bits = agg_partition_bits(
+      n / nworkers, sizeof(bmap_t) + partial_value_size * BUCKET_COUNT);
+  size_t npartitions = (size_t)1 << partition_bits;
+  agg_worker_t *workers = calloc(nworkers, sizeof(agg_worker_t));
+  hmap_t **partials = calloc(nworkers * npartitions, sizeof(hmap_t *));
+  if (!workers || !partials) {
+    free(partials);
+    free(workers);
+    return MAP_OOM;
+  }
+
+  agg_task_t task = {
+      .h = h,
+      .keys = keys,
+      .deltas = deltas,
+      .n = n,
+      .combine = combine,
+      .nworkers = nworkers,
+      .partition_bits = partition_bits,
+      .npartitions = npartitions,
+      .partials = partials,
+  };
+  atomic_init(&task.next_partition, 0);
+  for (size_t i = 0; i < nworkers; i++) {
+    workers[i].task = &task;
+    workers[i].id = i;
+  }
+  // Partial maps borrow keys from the records, the final insertion copies
+  // them if `h` owns its keys.
+  for (size_t i = 0; i < nworkers * npartitions; i++)
+    partials[i] = makemap(partial_value_size, 0, 0);
+
+  agg_run(workers, nworkers, agg_worker_partition);
+  agg_run(workers, nworkers, agg_worker_merge);
+  // `h` is not thread-safe so it is filled serially on this thread, with each
+  // key arriving only once by now.
+  for (size_t p = 0; p < npartitions; p++)
+    merge_partial(h, h, partials[p], combine);
+
+  free(partials);
+  free(workers);
   return MAP_OK;
 }
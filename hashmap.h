@@ -6,13 +6,30 @@
 
 typedef void *map_t;
 
+typedef void (*hashmap_iter_fn)(const char *key, void *value, void *ctx);
+typedef void (*hashmap_fold_fn)(void *acc, const char *key, const void *value,
+                                void *ctx);
+typedef void (*hashmap_merge_fn)(void *acc, const void *other, void *ctx);
+typedef void (*hashmap_combine_fn)(void *value, const void *delta);
+
 #define MAP_NOT_FOUND -2 // No such element
 #define MAP_OOM -1       // Out of Memory
 #define MAP_OK 0         // Ok
 
-#define hashmap_new(value_type, hint) _hashmap_new(sizeof(value_type), hint)
+// Back bucket arrays of at least one huge page with mmap and huge pages,
+// falling back to regular pages when they are unavailable.
+#define MAP_OPT_HUGE_PAGES 1
+// Pad buckets to a multiple of the cache line size and align them to it.
+#define MAP_OPT_CACHE_ALIGN 2
+// Copy inserted keys into an arena owned by the map and released by
+// `hashmap_free`, so callers need not keep them alive.
+#define MAP_OPT_OWNED_KEYS 4
+
+#define hashmap_new(value_type, hint) _hashmap_new(sizeof(value_type), hint, 0)
+#define hashmap_new_opts(value_type, hint, opts)                               \
+  _hashmap_new(sizeof(value_type), hint, opts)
 
-map_t _hashmap_new(uint8_t value_size, size_t hint);
+map_t _hashmap_new(uint8_t value_size, size_t hint, uint8_t opts);
 
 void hashmap_free(map_t m);
 
@@ -24,6 +41,38 @@ int hashmap_get(map_t m, const char *key, void *value_ref);
 
 int hashmap_insert(map_t m, const char *key, const void *value_ref);
 
+// Return the key stored in the map that equals `key`, inserting it with a
+// zero value if absent. With `MAP_OPT_OWNED_KEYS` the returned pointer is
+// canonical and stays valid until `hashmap_free`.
+const char *hashmap_intern(map_t m, const char *key);
+
 int hashmap_remove(map_t m, const char *key, void *value_ref);
 
+// Store `delta` as the value of `key` if absent, otherwise call `combine` to
+// fold it into the existing value, with a single lookup.
+int hashmap_accumulate(map_t m, const char *key, const void *delta,
+                       hashmap_combine_fn combine);
+
+// `hashmap_accumulate` the `n` records `keys[i]` with deltas
+// `deltas + i * sizeof(value)` using `nthreads` threads. Each thread
+// pre-aggregates its share into private maps, one per hash partition sized to
+// fit in cache. The threads then merge them partition by partition, and the
+// merged partitions are folded into `m` serially on the calling thread.
+// `combine` must be associative and commutative.
+int hashmap_parallel_accumulate(map_t m, size_t nthreads,
+                                const char *const *keys, const void *deltas,
+                                size_t n, hashmap_combine_fn combine);
+
+// Call `fn` on every entry using `nthreads` threads. `fn` may update the value
+// in place but the map must not be modified until this returns.
+int hashmap_parallel_for_each(map_t m, size_t nthreads, hashmap_iter_fn fn,
+                              void *ctx);
+
+// Fold every entry into per-thread copies of `acc` with `fold`, then `merge`
+// them into `acc`. `acc` must hold the identity of `merge` on entry and holds
+// the result on return.
+int hashmap_parallel_reduce(map_t m, size_t nthreads, hashmap_fold_fn fold,
+                            hashmap_merge_fn merge, void *acc,
+                            size_t acc_size, void *ctx);
+
 #endif
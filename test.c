@@ -89,6 +89,7 @@ void test_basic() {
     assert(ret == MAP_OK);
   }
   hashmap_print(m);
+  hashmap_free(m);
 
   for (int i = 0; i < cnt; i++) {
     free(keys[i]);
@@ -96,4 +97,207 @@ void test_basic() {
   free(keys);
 }
 
-int main() { test_basic(); }
+void test_huge_pages_and_cache_align() {
+  // Large enough for the bucket array to span several huge pages and to grow
+  // across the huge page threshold.
+  const int cnt = 200000;
+  char **const keys = calloc(cnt, sizeof(char *));
+  map_t m = hashmap_new_opts(int, 0, MAP_OPT_HUGE_PAGES | MAP_OPT_CACHE_ALIGN);
+
+  for (int i = 0; i < cnt; i++) {
+    keys[i] = malloc(16);
+    snprintf(keys[i], 16, "key%d", i);
+    int ret = hashmap_insert(m, keys[i], &i);
+    assert(ret == MAP_OK);
+  }
+
+  for (int i = 0; i < cnt; i++) {
+    int x;
+    int ret = hashmap_get(m, keys[i], &x);
+    assert(ret == MAP_OK);
+    assert(x == i);
+  }
+  assert(hashmap_get(m, "missing", NULL) == MAP_NOT_FOUND);
+  hashmap_free(m);
+
+  for (int i = 0; i < cnt; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+}
+
+void test_owned_keys() {
+  const int cnt = 20000;
+  map_t m = hashmap_new_opts(int, 0, MAP_OPT_OWNED_KEYS);
+  char key[16];
+
+  // Keys are written into the same buffer, so the map must keep its own copy.
+  for (int i = 0; i < cnt; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    int ret = hashmap_insert(m, key, &i);
+    assert(ret == MAP_OK);
+  }
+
+  for (int i = 0; i < cnt; i++) {
+    int x;
+    snprintf(key, sizeof(key), "key%d", i);
+    int ret = hashmap_get(m, key, &x);
+    assert(ret == MAP_OK);
+    assert(x == i);
+  }
+
+  // Interning returns the stored copy and does not touch existing values.
+  snprintf(key, sizeof(key), "key%d", 42);
+  const char *k0 = hashmap_intern(m, key);
+  assert(k0 != key && strcmp(k0, key) == 0);
+  assert(hashmap_intern(m, "key42") == k0);
+  int x;
+  assert(hashmap_get(m, "key42", &x) == MAP_OK && x == 42);
+
+  // Absent keys are inserted with a zero value.
+  const char *k1 = hashmap_intern(m, "new");
+  assert(strcmp(k1, "new") == 0);
+  assert(hashmap_get(m, "new", &x) == MAP_OK && x == 0);
+
+  // Keys that do not fit in a chunk are stored as well, without abandoning
+  // the chunk being filled: the next short key lands right after `k1`.
+  char *long_key = malloc(100000);
+  memset(long_key, 'x', 99999);
+  long_key[99999] = '\0';
+  const char *k2 = hashmap_intern(m, long_key);
+  assert(k2 != long_key && strcmp(k2, long_key) == 0);
+  free(long_key);
+  assert(hashmap_intern(m, "new2") == k1 + strlen(k1) + 1);
+
+  hashmap_free(m);
+}
+
+typedef struct _sum_t {
+  size_t count;
+  size_t sum;
+} sum_t;
+
+void sum_iter(const char *key, void *value, void *ctx) {
+  (void)key;
+  _Atomic size_t *sums = ctx;
+  sums[0]++;
+  sums[1] += *(int *)value;
+  // Values may be updated in place.
+  *(int *)value += 1;
+}
+
+void sum_fold(void *acc, const char *key, const void *value, void *ctx) {
+  (void)key;
+  (void)ctx;
+  sum_t *s = acc;
+  s->count++;
+  s->sum += *(const int *)value;
+}
+
+void sum_merge(void *acc, const void *other, void *ctx) {
+  (void)ctx;
+  sum_t *s = acc;
+  const sum_t *o = other;
+  s->count += o->count;
+  s->sum += o->sum;
+}
+
+void test_parallel_for_each() {
+  // The hint gives 1024 buckets, which start growing at the 6657th insert. The
+  // remaining inserts evacuate only a few old buckets, so the map is iterated
+  // in the middle of growing.
+  const int cnt = 6700;
+  map_t m = hashmap_new_opts(int, 6000, MAP_OPT_OWNED_KEYS);
+  char key[16];
+  size_t want = 0;
+  for (int i = 0; i < cnt; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    hashmap_insert(m, key, &i);
+    want += i;
+  }
+  assert(hashmap_len(m) == (size_t)cnt);
+
+  for (size_t nthreads = 1; nthreads <= 4; nthreads++) {
+    _Atomic size_t sums[2] = {0, 0};
+    int ret = hashmap_parallel_for_each(m, nthreads, sum_iter, sums);
+    assert(ret == MAP_OK);
+    assert(sums[0] == (size_t)cnt);
+    assert(sums[1] == want);
+    want += cnt;
+
+    sum_t acc = {0, 0};
+    ret = hashmap_parallel_reduce(m, nthreads, sum_fold, sum_merge, &acc,
+                                  sizeof(acc), NULL);
+    assert(ret == MAP_OK);
+    assert(acc.count == (size_t)cnt);
+    assert(acc.sum == want);
+  }
+
+  hashmap_free(m);
+}
+
+void add_size(void *value, const void *delta) {
+  *(size_t *)value += *(const size_t *)delta;
+}
+
+void test_accumulate() {
+  const size_t nwords = 500;
+  const size_t cnt = 20000;
+  char(*words)[16] = calloc(nwords, sizeof(*words));
+  for (size_t i = 0; i < nwords; i++)
+    snprintf(words[i], sizeof(words[i]), "word%zu", i);
+
+  const char **keys = calloc(cnt, sizeof(char *));
+  size_t *deltas = calloc(cnt, sizeof(size_t));
+  size_t *want = calloc(nwords, sizeof(size_t));
+  for (size_t i = 0; i < cnt; i++) {
+    size_t w = (size_t)rand() % nwords;
+    keys[i] = words[w];
+    deltas[i] = i % 3 + 1;
+    want[w] += deltas[i];
+  }
+
+  map_t m = hashmap_new(size_t, 0);
+  for (size_t i = 0; i < cnt; i++) {
+    int ret = hashmap_accumulate(m, keys[i], &deltas[i], add_size);
+    assert(ret == MAP_OK);
+  }
+  for (size_t w = 0; w < nwords; w++) {
+    size_t x = 0;
+    if (want[w])
+      assert(hashmap_get(m, words[w], &x) == MAP_OK);
+    assert(x == want[w]);
+  }
+  hashmap_free(m);
+
+  for (size_t nthreads = 1; nthreads <= 4; nthreads++) {
+    // Owned keys must survive the partial maps borrowing them.
+    m = hashmap_new_opts(size_t, 0, MAP_OPT_OWNED_KEYS);
+    int ret =
+        hashmap_parallel_accumulate(m, nthreads, keys, deltas, cnt, add_size);
+    assert(ret == MAP_OK);
+    // Accumulating twice exercises merging into existing entries.
+    ret = hashmap_parallel_accumulate(m, nthreads, keys, deltas, cnt, add_size);
+    assert(ret == MAP_OK);
+    for (size_t w = 0; w < nwords; w++) {
+      size_t x = 0;
+      if (want[w])
+        assert(hashmap_get(m, words[w], &x) == MAP_OK);
+      assert(x == 2 * want[w]);
+    }
+    hashmap_free(m);
+  }
+
+  free(want);
+  free(deltas);
+  free(keys);
+  free(words);
+}
+
+int main() {
+  test_basic();
+  test_huge_pages_and_cache_align();
+  test_owned_keys();
+  test_parallel_for_each();
+  test_accumulate();
+}